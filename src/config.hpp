@@ -0,0 +1,50 @@
+/*
+ * Copyright 2019 Ville Sundell/CRYPTOSUVI OSK
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <eosio/name.hpp>
+#include <eosio/symbol.hpp>
+
+/* Chain specific constants of a recovery campaign. Every build picks one of these
+   with -DRECOVERY_CONFIG=<name> (see src/CMakeLists.txt), so all of it is resolved
+   at compile time, and stages which are not enabled are left out of the contract. */
+namespace recovery_config {
+   using eosio::name;
+   using eosio::symbol;
+   using eosio::symbol_code;
+
+   struct telos {
+      static constexpr name system_account = "eosio"_n;
+      static constexpr name token_account = "eosio.token"_n;
+      static constexpr symbol core_symbol = symbol(symbol_code("TLOS"), 4);
+      static constexpr uint32_t refund_delay_sec = 3 * 24 * 3600;
+      static constexpr const char* memo = "Recovering tokens per TBNOA: https://chainspector.io/dashboard/ratify-proposals/0";
+
+      static constexpr bool unstake_stage = true;
+
+      /* Purchased RAM above the usage given to add() is sold before recovery */
+      static constexpr bool ram_stage = true;
+
+      static constexpr bool bidrefund_stage = true;
+   };
+}
+
+#ifndef RECOVERY_CONFIG
+#define RECOVERY_CONFIG telos
+#endif
+
+typedef recovery_config::RECOVERY_CONFIG config;
@@ -16,27 +16,266 @@
 
 #include <eosio/eosio.hpp>
 #include <eosio/asset.hpp>
+#include <eosio/crypto.hpp>
 #include <eosio/name.hpp>
+#include <eosio/singleton.hpp>
 #include <eosio.system/eosio.system.hpp>
 #include <eosio.token/eosio.token.hpp>
 
+#include <algorithm>
+#include <optional>
+
+#include "config.hpp"
+
 /* We can leave debug messages on, since that could help solving problems on Mainnet */
 #define DEBUG(...) print("tlosrecovery: ", __VA_ARGS__, "\n");
 
 using namespace eosio;
 
+/* An inline action which is packed once, after which only the actor of its single
+   authorization and fields of its data are patched in place before each send. This
+   saves building the permission vector, packing the memo and serializing the whole
+   action again for every account in a batch. Data offsets are in serialized bytes. */
+class inline_template {
+   public:
+      template<typename... Args>
+      inline_template(name code, name action_name, Args&&... args) {
+         action act(permission_level(name(), "active"_n), code, action_name, std::make_tuple(std::forward<Args>(args)...));
+         packed = pack(act);
+         data_offset = packed.size() - act.data.size();
+      }
+
+      void set_actor(name actor) {
+         write(actor_offset, actor);
+      }
+
+      template<typename T>
+      void set(size_t offset, const T& value) {
+         write(data_offset + offset, value);
+      }
+
+      void send() {
+         internal_use_do_not_use::send_inline(packed.data(), packed.size());
+      }
+
+   private:
+      /* account, name and the length of the authorization vector precede the actor */
+      static constexpr size_t actor_offset = 8 + 8 + 1;
+
+      std::vector<char> packed;
+      size_t data_offset;
+
+      template<typename T>
+      void write(size_t offset, const T& value) {
+         datastream<char*> ds(packed.data() + offset, packed.size() - offset);
+         ds << value;
+      }
+};
+
 class [[eosio::contract]] tlosrecovery : public contract {
    public:
       using contract::contract;
 
+      /* Accounts to unstake carry the tokens they held when added (stake and liquid),
+         unstake() takes the most valuable ones first since every account costs
+         about the same to crank. recover() goes by maturity instead, see recovery. */
       struct [[eosio::table]] account {
          name account_name;
+         time_point_sec added;
+         int64_t value = 0;
+         int64_t ram_usage = 0;        /* As given to add(), see sellable_ram() */
          auto primary_key() const { return account_name.value; }
+         uint64_t by_value() const { return std::numeric_limits<uint64_t>::max() - static_cast<uint64_t>(value); }
+      };
+
+      /* Accounts waiting for recovery also carry the time their refund matures (zero if
+         there is nothing to wait for), so recover() can walk them in maturity order and
+         crankers can see from the "bymaturity" index when the next group becomes ready */
+      struct [[eosio::table]] recovery {
+         name account_name;
+         time_point_sec matures;
+         time_point_sec added;
+         time_point_sec unstaked;      /* Zero if the account was added directly here */
+         int64_t ram_usage = 0;        /* As given to add(), see sellable_ram() */
+         auto primary_key() const { return account_name.value; }
+         uint64_t by_maturity() const { return matures.sec_since_epoch(); }
       };
 
       /* By having a two separate tables, we are building an implicit and safe state machine */
-      typedef multi_index<"unstake"_n, account> unstake_accounts;
-      typedef multi_index<"recover"_n, account> recover_accounts;
+      typedef multi_index<"unstake"_n, account,
+         indexed_by<"byvalue"_n, const_mem_fun<account, uint64_t, &account::by_value>>
+      > unstake_accounts;
+      typedef multi_index<"recover"_n, recovery,
+         indexed_by<"bymaturity"_n, const_mem_fun<recovery, uint64_t, &recovery::by_maturity>>
+      > recover_accounts;
+
+      /* Every recovery round is a campaign of its own: the account tables and the singletons
+         below are scoped by the campaign name, so rounds can be cranked without touching
+         each other's rows, and a finished round can be closed and deleted in bulk */
+      struct [[eosio::table]] campaign {
+         name campaign_name;
+         bool closed = false;
+         auto primary_key() const { return campaign_name.value; }
+      };
+      typedef multi_index<"campaigns"_n, campaign> campaigns;
+
+      /* Name auction bids with refunds waiting to be claimed. bidrefunds rows are scoped by
+         the name bid on, so they can't be found from the bidder alone and the operator
+         registers them with addbidrefs() (before add(), which would prune accounts with
+         nothing else to recover). recover() claims them before the transfer. */
+      struct [[eosio::table]] bid_reference {
+         uint64_t id;
+         name bidder;
+         name newname;
+         uint64_t primary_key() const { return id; }
+         uint64_t by_bidder() const { return bidder.value; }
+      };
+      typedef multi_index<"bidrefs"_n, bid_reference,
+         indexed_by<"bybidder"_n, const_mem_fun<bid_reference, uint64_t, &bid_reference::by_bidder>>
+      > bid_references;
+
+      struct bid {
+         name bidder;
+         name newname;
+      };
+
+      /* An account to add, with the RAM it uses (ram_usage of get_account) */
+      struct listing {
+         name account_name;
+         int64_t ram_usage;
+      };
+
+      /* Accounts which must never be added: exchanges, known active users and everyone
+         who has called removeme() and hence become a party to the TBNOA */
+      struct [[eosio::table]] protection {
+         name account_name;
+         auto primary_key() const { return account_name.value; }
+      };
+      typedef multi_index<"protected"_n, protection> protected_accounts;
+
+      /* Running totals of a campaign, so progress can be followed with a single table
+         query instead of paging through the account lists */
+      struct [[eosio::table]] statistics {
+         uint64_t unstake_rows = 0;    /* Accounts waiting in the unstake table */
+         uint64_t recover_rows = 0;    /* Accounts waiting in the recover table */
+         uint64_t unstaked = 0;        /* undelegatebw sent */
+         uint64_t refunded = 0;        /* refund sent */
+         uint64_t recovered = 0;       /* transfer sent */
+         uint64_t empty = 0;           /* Dropped with nothing to recover */
+         uint64_t pruned = 0;          /* Not added, since there was nothing to recover */
+         uint64_t excluded = 0;        /* Not added, since it is a system, protected or our account */
+         uint64_t immature = 0;        /* Pushed back in the queue because of a new refund */
+         uint64_t ram_sold = 0;        /* Bytes of RAM sold */
+         uint64_t bid_refunds = 0;     /* bidrefund sent */
+         asset recovered_amount = asset(0, config::core_symbol);
+         checksum256 list_digest;      /* Multiset digest of the listed names, see update_digest() */
+      };
+      typedef singleton<"stats"_n, statistics> statistics_singleton;
+
+      /* Order independent digest of the names in the unstake and recover tables together,
+         maintained incrementally: the sum modulo 2^256 of sha256(name.value as 8 little
+         endian bytes) over all names, every hash read as a big endian integer. unstake()
+         moving a name between the tables leaves it as it is. Verifying the tables against
+         a candidate list takes computing the same sum over the list instead of dumping them.
+         This only catches accidental mismatches: a modular sum of hashes is not collision
+         resistant, so a deliberately crafted list can match it (see README.md). */
+      static void update_digest(checksum256& digest, name account_name, bool insert) {
+         auto element = sha256(reinterpret_cast<const char*>(&account_name.value), sizeof(account_name.value)).extract_as_byte_array();
+         auto sum = digest.extract_as_byte_array();
+
+         int carry = 0;
+         for(int i = sum.size() - 1; i >= 0; i--) {
+            int byte = insert ? sum[i] + element[i] + carry : sum[i] - element[i] + carry;
+            sum[i] = byte & 0xff;
+            carry = byte < 0 ? -1 : byte >> 8;
+         }
+
+         digest = checksum256(sum);
+      }
+
+      /* Stage to stage latencies of a campaign as log2 histograms of seconds:
+         bucket 0 counts zero seconds, bucket b counts [2^(b-1), 2^b) seconds */
+      struct [[eosio::table]] latencies {
+         std::vector<uint64_t> add_to_unstake;
+         std::vector<uint64_t> unstake_to_recover;
+         std::vector<uint64_t> add_to_recover;
+      };
+      typedef singleton<"latency"_n, latencies> latencies_singleton;
+
+      static constexpr size_t latency_buckets = 32;
+
+      static void record_latency(std::vector<uint64_t>& histogram, time_point_sec from, time_point_sec to) {
+         uint64_t seconds = to > from ? to.sec_since_epoch() - from.sec_since_epoch() : 0;
+         size_t bucket = seconds == 0 ? 0 : 64 - __builtin_clzll(seconds);
+
+         histogram.resize(latency_buckets);
+         histogram[std::min(bucket, latency_buckets - 1)]++;
+      }
+
+      /* Reason codes of the transition events, never renumber these */
+      enum class transition_reason : uint8_t {
+         added = 0,
+         removed = 1,
+         unstaked = 2,
+         nothing_staked = 3,
+         refunded = 4,
+         refund_pending = 5,
+         recovered = 6,
+         nothing_to_recover = 7,
+         pruned = 8,
+         excluded = 9
+      };
+
+      /* Leading fields of the eosio.system and eosio.token rows we look at, in their
+         serialized order. Only these bytes are read and unpacked, see read_row() */
+      struct staked_row {         /* eosio::delband, the whole row */
+         name from;
+         name to;
+         asset net_weight;
+         asset cpu_weight;
+         EOSLIB_SERIALIZE(staked_row, (from)(to)(net_weight)(cpu_weight))
+      };
+
+      struct refund_row {         /* eosio::refunds, up to request_time */
+         name owner;
+         time_point_sec request_time;
+         EOSLIB_SERIALIZE(refund_row, (owner)(request_time))
+      };
+
+      struct resources_row {      /* eosio::userres, the whole row */
+         name owner;
+         asset net_weight;
+         asset cpu_weight;
+         int64_t ram_bytes;
+         EOSLIB_SERIALIZE(resources_row, (owner)(net_weight)(cpu_weight)(ram_bytes))
+      };
+
+      struct bid_refund_row {     /* eosio::bidrefunds, up to bidder */
+         name bidder;
+         EOSLIB_SERIALIZE(bid_refund_row, (bidder))
+      };
+
+      struct balance_row {        /* eosio.token::accounts, the whole row */
+         asset balance;
+         EOSLIB_SERIALIZE(balance_row, (balance))
+      };
+
+      /* Reads the fixed size leading fields of a row of another contract straight from
+         the database. multi_index would deserialize and cache the whole row, only for us
+         to look at a field or two of it. */
+      template<typename T>
+      static std::optional<T> read_row(name code, uint64_t scope, name table, uint64_t primary_key) {
+         int32_t iterator = internal_use_do_not_use::db_find_i64(code.value, scope, table.value, primary_key);
+         if(iterator < 0) {
+            return std::nullopt;
+         }
+
+         char buffer[sizeof(T)];
+         const size_t size = pack_size(T());
+         internal_use_do_not_use::db_get_i64(iterator, buffer, size);
+
+         return unpack<T>(buffer, size);
+      }
 
       /* Originally I had plans to make this contract completely autonomous:
             * Let anyone add accounts
@@ -48,38 +287,204 @@ class [[eosio::contract]] tlosrecovery : public contract {
          a single use contract, autonomous function is not needed. Hence, require_auth().
       */
 
-      void add_internal(name account_name) {
+      /* Returns when a pending refund of the account can be claimed, or zero if there is none */
+      time_point_sec refund_maturity(name account_name) {
+         auto refund = read_row<refund_row>(config::system_account, account_name.value, "refunds"_n, account_name.value);
+         if(!refund) {
+            return time_point_sec();
+         }
+
+         return refund->request_time + config::refund_delay_sec;
+      }
+
+      /* Every state change of an account is emitted as an inline transition() action,
+         so per account outcomes can be read from action traces with the ABI instead of
+         parsing the DEBUG prints. The tables are the states, name() means no table. */
+      void log_transition(name campaign_name, name account_name, name from, name to, asset amount, transition_reason reason) {
+         transition_action event(get_self(), std::vector<permission_level>());
+         event.send(campaign_name, account_name, from, to, amount, static_cast<uint8_t>(reason));
+      }
+
+      /* token::get_balance() asserts if the account has no token row at all,
+         so we look the row up ourselves and treat a missing row as zero balance */
+      asset liquid_balance(name account_name) {
+         auto row = read_row<balance_row>(config::token_account, account_name.value, "accounts"_n, config::core_symbol.code().raw());
+         return row ? row->balance : asset(0, config::core_symbol);
+      }
+
+      /* Purchased RAM the account can sell, zero if the RAM stage is not enabled.
+         Contracts can't read RAM usage, so the operator measures it before add(), and
+         sellram() would assert (failing the whole batch) if we sold into it. Usage can
+         only grow with the account's own authority, which an unused account never gives.
+         Any RAM gift of the system contract is left unsold on top of that. */
+      int64_t sellable_ram(name account_name, int64_t ram_usage) {
+         if constexpr (config::ram_stage) {
+            auto resources = read_row<resources_row>(config::system_account, account_name.value, "userres"_n, account_name.value);
+            if(resources && resources->ram_bytes > ram_usage) {
+               return resources->ram_bytes - ram_usage;
+            }
+         }
+
+         return 0;
+      }
+
+      bool has_bid_references(name campaign_name, name account_name) {
+         if constexpr (config::bidrefund_stage) {
+            bid_references references(get_self(), campaign_name.value);
+            auto by_bidder = references.get_index<"bybidder"_n>();
+            return by_bidder.find(account_name.value) != by_bidder.end();
+         }
+
+         return false;
+      }
+
+      /* Sends bidrefund for every registered bid of the account which still has a refund,
+         and forgets the bids. Returns whether anything was sent. */
+      bool claim_bid_refunds(name campaign_name, name account_name, inline_template& claimer, statistics& stats) {
+         bool claimed = false;
+
+         if constexpr (config::bidrefund_stage) {
+            bid_references references(get_self(), campaign_name.value);
+            auto by_bidder = references.get_index<"bybidder"_n>();
+            std::vector<name> claimed_names;
+
+            for(auto reference_iterator = by_bidder.lower_bound(account_name.value);
+                reference_iterator != by_bidder.end() && reference_iterator->bidder == account_name;) {
+               /* bidrefund() erases the refund, so a repeated name would fail the whole batch */
+               bool repeated = std::find(claimed_names.begin(), claimed_names.end(), reference_iterator->newname) != claimed_names.end();
+
+               if(!repeated && read_row<bid_refund_row>(config::system_account, reference_iterator->newname.value, "bidrefunds"_n, account_name.value)) {
+                  claimer.set_actor(account_name);
+                  claimer.set(0, account_name);
+                  claimer.set(8, reference_iterator->newname);
+                  claimer.send();
+                  DEBUG("Sent inline transaction eosio::bidrefund() for: ", reference_iterator->newname);
+                  stats.bid_refunds++;
+                  claimed_names.push_back(reference_iterator->newname);
+                  claimed = true;
+               }
+
+               reference_iterator = by_bidder.erase(reference_iterator);
+            }
+         }
+
+         return claimed;
+      }
+
+      void forget_bid_references(name campaign_name, name account_name) {
+         bid_references references(get_self(), campaign_name.value);
+         auto by_bidder = references.get_index<"bybidder"_n>();
+
+         for(auto reference_iterator = by_bidder.lower_bound(account_name.value);
+             reference_iterator != by_bidder.end() && reference_iterator->bidder == account_name;) {
+            reference_iterator = by_bidder.erase(reference_iterator);
+         }
+      }
+
+      /* The system account and every "<system account>.*" account share the top bits of
+         the name: the characters of the system account followed by a dot (encoded as zero) */
+      static bool is_system_account(name account_name) {
+         constexpr int shift = 64 - (config::system_account.length() + 1) * 5;
+         return (account_name.value >> shift) == (config::system_account.value >> shift);
+      }
+
+      bool is_protected(name account_name) {
+         protected_accounts protecting(get_self(), get_self().value);
+         return protecting.find(account_name.value) != protecting.end();
+      }
+
+      void protect_internal(name account_name, name payer) {
+         protected_accounts protecting(get_self(), get_self().value);
+         if(protecting.find(account_name.value) == protecting.end()) {
+            protecting.emplace(payer, [&](auto& a) {
+               a.account_name = account_name;
+            });
+         }
+      }
+
+      void add_internal(name campaign_name, name account_name, int64_t ram_usage, statistics& stats) {
+         /* recover() would have us transfer to ourselves, which eosio.token refuses */
+         if(account_name == get_self() || is_system_account(account_name) || is_protected(account_name)) {
+            stats.excluded++;
+            log_transition(campaign_name, account_name, name(), name(), asset(0, config::core_symbol), transition_reason::excluded);
+            DEBUG("Account is protected, not adding: ", account_name);
+            return;
+         }
+
          /* Here we check should we place the account to the unstaking list,
             or directly to the token recovery list */
 
-         eosiosystem::del_bandwidth_table staked("eosio"_n, account_name.value);
-         auto staked_iterator = staked.find(account_name.value);
-         if(staked_iterator != staked.end()) {
+         std::optional<staked_row> staked;
+         if constexpr (config::unstake_stage) {
+            staked = read_row<staked_row>(config::system_account, account_name.value, "delband"_n, account_name.value);
+         }
+
+         if(staked) {
             /* We put the account to the unstaking list */
-            /* we use _this, _this scope for simplicity */
-            unstake_accounts unstaking(get_self(), get_self().value);
+            unstake_accounts unstaking(get_self(), campaign_name.value);
 
             /* It would be a fun idea to get the account to pay (since we will be
                privileged), but that would have complicated testing.
                And would need total refactoring of the contract. */
             unstaking.emplace(get_self(), [&](auto& a) {
                a.account_name = account_name;
+               a.added = time_point_sec(current_time_point());
+               a.value = (staked->net_weight + staked->cpu_weight + liquid_balance(account_name)).amount;
+               a.ram_usage = ram_usage;
             });
 
+            stats.unstake_rows++;
+            update_digest(stats.list_digest, account_name, true);
+            log_transition(campaign_name, account_name, name(), "unstake"_n, asset(0, config::core_symbol), transition_reason::added);
             DEBUG("Adding account to the unstaking list: ", account_name);
          } else {
             /* Nothing to unstake, let's just recover the funds */
+            time_point_sec matures = refund_maturity(account_name);
+
+            /* Without stake, refund, balance or RAM to sell, recover() could only ever erase
+               the row, so we don't spend RAM and crank CPU on storing it in the first place */
+            if(matures == time_point_sec() && liquid_balance(account_name).amount == 0 && sellable_ram(account_name, ram_usage) == 0 &&
+               !has_bid_references(campaign_name, account_name)) {
+               stats.pruned++;
+               log_transition(campaign_name, account_name, name(), name(), asset(0, config::core_symbol), transition_reason::pruned);
+               DEBUG("Nothing to recover, not adding: ", account_name);
+               return;
+            }
 
-            recover_accounts recovering(get_self(), get_self().value);
+            recover_accounts recovering(get_self(), campaign_name.value);
 
             recovering.emplace(get_self(), [&](auto& a) {
                a.account_name = account_name;
+               a.matures = matures;
+               a.added = time_point_sec(current_time_point());
+               a.ram_usage = ram_usage;
             });
 
+            stats.recover_rows++;
+            update_digest(stats.list_digest, account_name, true);
+            log_transition(campaign_name, account_name, name(), "recover"_n, asset(0, config::core_symbol), transition_reason::added);
             DEBUG("Adding account to the recovery list: ", account_name);
          }
       }
 
+      /* Adding to a campaign opens it */
+      void open_campaign(name campaign_name) {
+         check(campaign_name != name(), "Campaign name must not be empty");
+         /* Our own scope holds the campaigns and protected tables, and the rows left
+            by the single campaign version of this contract */
+         check(campaign_name != get_self(), "Campaign name is reserved");
+
+         campaigns campaign_table(get_self(), get_self().value);
+         auto campaign_iterator = campaign_table.find(campaign_name.value);
+         if(campaign_iterator == campaign_table.end()) {
+            campaign_table.emplace(get_self(), [&](auto& c) {
+               c.campaign_name = campaign_name;
+            });
+         } else {
+            check(!campaign_iterator->closed, "Campaign is closed");
+         }
+      }
+
       /* There is one known corner case with add():
          if account is added while staked, and then the account unstakes by
          themselves, and the contract operator adds the account again, then
@@ -92,127 +497,528 @@ class [[eosio::contract]] tlosrecovery : public contract {
          by BP multisig.
        */
       [[eosio::action]]
-      void add(std::vector<name> account_names) {
+      void add(name campaign_name, std::vector<listing> accounts) {
          require_auth(get_self());
+         open_campaign(campaign_name);
 
-         for(auto& account_name : account_names) {
-            add_internal(account_name);
+         statistics_singleton statistics_table(get_self(), campaign_name.value);
+         auto stats = statistics_table.get_or_default();
+
+         for(auto& a : accounts) {
+            check(a.ram_usage >= 0, "RAM usage must not be negative");
+            add_internal(campaign_name, a.account_name, a.ram_usage, stats);
          }
+
+         statistics_table.set(stats, get_self());
       }
 
-      void remove_internal(name account_name) {
+      /* Returns whether the account was found in the campaign */
+      bool remove_internal(name campaign_name, name account_name, statistics& stats) {
+         bool found = false;
+
          /* Removing recovering could be inside an IF, but we want also handle cases
             that we think are impossible at the moment (since it does not cost us anything),
             welcome to smart contracts :D */
 
-         unstake_accounts unstaking(get_self(), get_self().value);
+         unstake_accounts unstaking(get_self(), campaign_name.value);
 
          auto unstaking_iterator = unstaking.find(account_name.value);
          if(unstaking_iterator != unstaking.end()) {
             DEBUG("Removing account from the unstake list: ", account_name);
             unstaking.erase(unstaking_iterator);
+            stats.unstake_rows--;
+            update_digest(stats.list_digest, account_name, false);
+            log_transition(campaign_name, account_name, "unstake"_n, name(), asset(0, config::core_symbol), transition_reason::removed);
+            found = true;
          }
 
-         recover_accounts recovering(get_self(), get_self().value);
+         recover_accounts recovering(get_self(), campaign_name.value);
 
          auto recovering_iterator = recovering.find(account_name.value);
          if(recovering_iterator != recovering.end()) {
             DEBUG("Removing account from the recovery list: ", account_name);
             recovering.erase(recovering_iterator);
+            stats.recover_rows--;
+            update_digest(stats.list_digest, account_name, false);
+            log_transition(campaign_name, account_name, "recover"_n, name(), asset(0, config::core_symbol), transition_reason::removed);
+            found = true;
          }
+
+         forget_bid_references(campaign_name, account_name);
+
+         return found;
+      }
+
+      /* Users don't know which campaigns they are in, so we look through all of them */
+      bool remove_from_all_campaigns(name account_name) {
+         campaigns campaign_table(get_self(), get_self().value);
+         bool removed = false;
+
+         for(auto& c : campaign_table) {
+            statistics_singleton statistics_table(get_self(), c.campaign_name.value);
+            auto stats = statistics_table.get_or_default();
+
+            if(remove_internal(c.campaign_name, account_name, stats)) {
+               statistics_table.set(stats, get_self());
+               removed = true;
+            }
+         }
+
+         return removed;
       }
 
       [[eosio::action]]
-      void remove(std::vector<name> account_names) {
+      void remove(name campaign_name, std::vector<name> account_names) {
          require_auth(get_self());
 
+         campaigns campaign_table(get_self(), get_self().value);
+         campaign_table.require_find(campaign_name.value, "Campaign not found");
+
+         statistics_singleton statistics_table(get_self(), campaign_name.value);
+         auto stats = statistics_table.get_or_default();
+
          for(auto& account_name : account_names) {
-            remove_internal(account_name);
+            remove_internal(campaign_name, account_name, stats);
          }
+
+         statistics_table.set(stats, get_self());
       }
 
       [[eosio::action]]
       void removeme(name account_name) {
          require_auth(account_name);
 
-         remove_internal(account_name);
+         /* We pay the RAM of accounts we had listed, since their freed rows cover it and
+            nobody should be prevented from removing themselves. Anyone else pays their own. */
+         bool listed = remove_from_all_campaigns(account_name);
+         protect_internal(account_name, listed ? get_self() : account_name);
+      }
+
+      /* Removes the accounts and makes sure they can never be added again */
+      [[eosio::action]]
+      void protect(std::vector<name> account_names) {
+         require_auth(get_self());
+
+         for(auto& account_name : account_names) {
+            remove_from_all_campaigns(account_name);
+            protect_internal(account_name, get_self());
+         }
+      }
+
+      /* Closes the campaign for good and deletes up to n of its remaining rows, once
+         everything is gone the campaign itself is deleted. Call again until it is. */
+      [[eosio::action]]
+      void close(name campaign_name, uint32_t n) {
+         require_auth(get_self());
+
+         campaigns campaign_table(get_self(), get_self().value);
+         auto campaign_iterator = campaign_table.require_find(campaign_name.value, "Campaign not found");
+         if(!campaign_iterator->closed) {
+            campaign_table.modify(campaign_iterator, same_payer, [&](auto& c) {
+               c.closed = true;
+            });
+         }
+
+         statistics_singleton statistics_table(get_self(), campaign_name.value);
+         auto stats = statistics_table.get_or_default();
+         unstake_accounts unstaking(get_self(), campaign_name.value);
+         recover_accounts recovering(get_self(), campaign_name.value);
+         uint32_t i = 0;
+
+         for(auto unstaking_iterator = unstaking.begin(); i < n && unstaking_iterator != unstaking.end(); i++) {
+            stats.unstake_rows--;
+            update_digest(stats.list_digest, unstaking_iterator->account_name, false);
+            log_transition(campaign_name, unstaking_iterator->account_name, "unstake"_n, name(), asset(0, config::core_symbol), transition_reason::removed);
+            unstaking_iterator = unstaking.erase(unstaking_iterator);
+         }
+
+         for(auto recovering_iterator = recovering.begin(); i < n && recovering_iterator != recovering.end(); i++) {
+            stats.recover_rows--;
+            update_digest(stats.list_digest, recovering_iterator->account_name, false);
+            log_transition(campaign_name, recovering_iterator->account_name, "recover"_n, name(), asset(0, config::core_symbol), transition_reason::removed);
+            recovering_iterator = recovering.erase(recovering_iterator);
+         }
+
+         bid_references references(get_self(), campaign_name.value);
+         for(auto reference_iterator = references.begin(); i < n && reference_iterator != references.end(); i++) {
+            reference_iterator = references.erase(reference_iterator);
+         }
+
+         if(unstaking.begin() == unstaking.end() && recovering.begin() == recovering.end() && references.begin() == references.end()) {
+            DEBUG("Campaign closed and deleted: ", campaign_name);
+            statistics_table.remove();
+            latencies_singleton(get_self(), campaign_name.value).remove();
+            campaign_table.erase(campaign_iterator);
+         } else {
+            DEBUG("Campaign closed, rows remaining: ", stats.unstake_rows + stats.recover_rows);
+            statistics_table.set(stats, get_self());
+         }
+      }
+
+      /* Registers bids on names whose refunds recover() should claim, see bid_reference */
+      [[eosio::action]]
+      void addbidrefs(name campaign_name, std::vector<bid> bids) {
+         require_auth(get_self());
+         open_campaign(campaign_name);
+
+         bid_references references(get_self(), campaign_name.value);
+
+         auto by_bidder = references.get_index<"bybidder"_n>();
+
+         for(auto& b : bids) {
+            /* A second row for the same bid would make recover() claim it twice */
+            for(auto reference_iterator = by_bidder.lower_bound(b.bidder.value);
+                reference_iterator != by_bidder.end() && reference_iterator->bidder == b.bidder;
+                reference_iterator++) {
+               check(reference_iterator->newname != b.newname, "Bid already registered");
+            }
+
+            references.emplace(get_self(), [&](auto& r) {
+               r.id = references.available_primary_key();
+               r.bidder = b.bidder;
+               r.newname = b.newname;
+            });
+         }
+      }
+
+      /* RAM billed by nodeos on top of the data (eosio::chain::config::billable_size_v):
+         for every row once for the primary key and once more for each 64-bit secondary
+         index, and for every table (the primary one and one per secondary index) in a
+         new scope */
+      static constexpr int64_t primary_row_overhead = 108;
+      static constexpr int64_t secondary_row_overhead = 128;
+      static constexpr int64_t table_overhead = 108;
+
+      /* Same bancor formula as exchange_state::get_bancor_input() in eosio.system,
+         which is only declared in the headers we compile against */
+      static int64_t bancor_input(int64_t out_reserve, int64_t inp_reserve, int64_t out) {
+         const double ob = out_reserve;
+         const double ib = inp_reserve;
+
+         int64_t inp = (ib * out) / (ob - out);
+         return inp < 0 ? 0 : inp;
+      }
+
+      /* RAM of the rows of the given accounts, if every row held accounts_per_row of them:
+         one is the current layout, more prices a denser one where the same fields are packed
+         back to back in a vector under a single key, with one secondary index entry per row */
+      static int64_t rows_bytes(int64_t accounts, int64_t account_bytes, int64_t accounts_per_row) {
+         if(accounts_per_row == 1) {
+            return accounts * (account_bytes + primary_row_overhead + secondary_row_overhead);
+         }
+
+         const int64_t rows = (accounts + accounts_per_row - 1) / accounts_per_row;
+         const int64_t row_bytes = sizeof(uint64_t) + pack_size(unsigned_int(accounts_per_row)) +
+                                   accounts_per_row * account_bytes + primary_row_overhead + secondary_row_overhead;
+         return rows * row_bytes;
+      }
+
+      /* Planning aid for the operator, changes nothing: prints how much RAM a new campaign
+         of the given number of staked (unstake table) and unstaked (recover table) accounts
+         needs at its peak with accounts_per_row accounts in a row (1 for the current layout),
+         and what buying it would cost at the current rammarket state */
+      [[eosio::action]]
+      void ramcost(uint32_t staked_accounts, uint32_t unstaked_accounts, uint32_t accounts_per_row) {
+         check(accounts_per_row > 0, "At least one account per row");
+
+         eosiosystem::rammarket market(config::system_account, config::system_account.value);
+         auto market_iterator = market.find(eosiosystem::system_contract::ramcore_symbol.raw());
+         check(market_iterator != market.end(), "RAM market not found");
+
+         const int64_t unstake_account_bytes = pack_size(account());
+         const int64_t recover_account_bytes = pack_size(recovery());
+
+         /* unstake() erases the unstake row of an account as it adds its recover row,
+            so a staked account only ever holds one of them */
+         const int64_t accounts_bytes = rows_bytes(staked_accounts, std::max(unstake_account_bytes, recover_account_bytes), accounts_per_row) +
+                                        rows_bytes(unstaked_accounts, recover_account_bytes, accounts_per_row);
+
+         /* The campaigns row, and in the campaign scope the unstake and recover tables
+            with their indexes, and the stats and latency singletons at their full size */
+         latencies full_latency;
+         full_latency.add_to_unstake.resize(latency_buckets);
+         full_latency.unstake_to_recover.resize(latency_buckets);
+         full_latency.add_to_recover.resize(latency_buckets);
+
+         const int64_t campaign_bytes = pack_size(campaign()) + primary_row_overhead +
+                                        6 * table_overhead +
+                                        pack_size(statistics()) + primary_row_overhead +
+                                        pack_size(full_latency) + primary_row_overhead;
+         const int64_t bytes = accounts_bytes + campaign_bytes;
+
+         const int64_t ram_reserve = market_iterator->base.balance.amount;
+         const int64_t tlos_reserve = market_iterator->quote.balance.amount;
+         check(bytes < ram_reserve, "Not enough RAM in the market");
+
+         /* Mirrors eosio::buyrambytes(), including the 0.5% fee */
+         const int64_t cost = bancor_input(ram_reserve, tlos_reserve, bytes);
+         const int64_t cost_plus_fee = cost / double(0.995);
+
+         const double price_before = double(tlos_reserve) / ram_reserve;
+         const double price_after = double(tlos_reserve + cost) / (ram_reserve - bytes);
+
+         DEBUG("Accounts per row: ", accounts_per_row, ", bytes per account: ", accounts_bytes / std::max<int64_t>(int64_t(staked_accounts) + unstaked_accounts, 1));
+         DEBUG("Bytes for the accounts: ", accounts_bytes, ", for the campaign itself: ", campaign_bytes);
+         DEBUG("RAM needed: ", bytes, " bytes, cost: ", asset(cost_plus_fee, config::core_symbol));
+         DEBUG("RAM price impact: ", (price_after / price_before - 1) * 100, "%");
+         DEBUG("Not included: bid references (addbidrefs) and protected accounts");
+      }
+
+      /* Event sink for log_transition(), the data is in the action trace */
+      [[eosio::action]]
+      void transition(name campaign_name, name account_name, name from, name to, asset amount, uint8_t reason) {
+         check(get_sender() == get_self(), "Only emitted by the contract itself");
+      }
+
+      using transition_action = action_wrapper<"transition"_n, &tlosrecovery::transition>;
+
+      /* Transfers the liquid balance of the account to us */
+      void sweep_internal(name campaign_name, name account_name, inline_template& transfer, statistics& stats) {
+         asset balance = liquid_balance(account_name);
+
+         if(balance.amount > 0) {
+            transfer.set_actor(account_name);
+            transfer.set(0, account_name);
+            transfer.set(16, balance);
+            transfer.send();
+            stats.recovered++;
+            stats.recovered_amount += balance;
+            log_transition(campaign_name, account_name, "recover"_n, name(), balance, transition_reason::recovered);
+         } else {
+            DEBUG("Nothing to recover, skipping...");
+            stats.empty++;
+            log_transition(campaign_name, account_name, "recover"_n, name(), asset(0, config::core_symbol), transition_reason::nothing_to_recover);
+         }
+      }
+
+      /* Bookkeeping for a recover row that is about to be erased */
+      void retire_recovery(const recovery& row, statistics& stats, latencies& latency, time_point_sec now) {
+         if(row.unstaked != time_point_sec()) {
+            record_latency(latency.unstake_to_recover, row.unstaked, now);
+         }
+         record_latency(latency.add_to_recover, row.added, now);
+
+         stats.recover_rows--;
+         update_digest(stats.list_digest, row.account_name, false);
+      }
+
+      /* The rest of recover() for an account whose RAM was sold or whose bid refunds
+         were claimed. It is sent inline after those actions, so the proceeds are already
+         in the balance when we read it. recover() leaves the row in place for us, so an
+         account can only be swept once and only while it is still on the list. */
+      [[eosio::action]]
+      void sweep(name campaign_name, name account_name) {
+         check(get_sender() == get_self(), "Only sent by the contract itself");
+
+         recover_accounts recovering(get_self(), campaign_name.value);
+         auto recovering_iterator = recovering.require_find(account_name.value, "Account is not being recovered");
+         statistics_singleton statistics_table(get_self(), campaign_name.value);
+         auto stats = statistics_table.get_or_default();
+         latencies_singleton latencies_table(get_self(), campaign_name.value);
+         auto latency = latencies_table.get_or_default();
+         inline_template transfer(config::token_account, "transfer"_n, name(), get_self(), asset(0, config::core_symbol), std::string(config::memo));
+
+         sweep_internal(campaign_name, account_name, transfer, stats);
+         retire_recovery(*recovering_iterator, stats, latency, time_point_sec(current_time_point()));
+         recovering.erase(recovering_iterator);
+
+         statistics_table.set(stats, get_self());
+         latencies_table.set(latency, get_self());
+      }
+
+      void require_open(name campaign_name) {
+         campaigns campaign_table(get_self(), get_self().value);
+         auto campaign_iterator = campaign_table.require_find(campaign_name.value, "Campaign not found");
+         check(!campaign_iterator->closed, "Campaign is closed");
       }
 
       /* unstake() and recover() work without account names to minimize attack surface */
       [[eosio::action]]
-      void unstake(uint8_t n) {
+      void unstake(name campaign_name, uint8_t n) {
          int i;
 
+         if constexpr (!config::unstake_stage) {
+            check(false, "Unstaking is not enabled in this build");
+            return;
+         }
+
+         require_open(campaign_name);
+
          DEBUG("Unstaking the next account from the list...");
-         unstake_accounts unstaking(get_self(), get_self().value);
+         unstake_accounts unstaking(get_self(), campaign_name.value);
+         auto by_value = unstaking.get_index<"byvalue"_n>();
+         statistics_singleton statistics_table(get_self(), campaign_name.value);
+         auto stats = statistics_table.get_or_default();
+         latencies_singleton latencies_table(get_self(), campaign_name.value);
+         auto latency = latencies_table.get_or_default();
+         time_point_sec now(current_time_point());
 
-         auto unstaking_iterator = unstaking.begin();
+         /* undelegatebw(from, receiver, unstake_net_quantity, unstake_cpu_quantity) */
+         inline_template unstaker(config::system_account, "undelegatebw"_n, name(), name(), asset(0, config::core_symbol), asset(0, config::core_symbol));
 
-         for(i = 0;  i < n && unstaking_iterator != unstaking.end(); i++) {
+         auto unstaking_iterator = by_value.begin();
+
+         for(i = 0;  i < n && unstaking_iterator != by_value.end(); i++) {
             DEBUG("Unstaking: ", unstaking_iterator->account_name);
-            eosiosystem::del_bandwidth_table staked("eosio"_n, unstaking_iterator->account_name.value);
-            auto staked_iterator = staked.find(unstaking_iterator->account_name.value);
-            if(staked_iterator != staked.end()) {
+            auto staked = read_row<staked_row>(config::system_account, unstaking_iterator->account_name.value, "delband"_n, unstaking_iterator->account_name.value);
+            time_point_sec matures;
+            asset unstaked_amount = asset(0, config::core_symbol);
+            if(staked && (staked->net_weight.amount > 0 || staked->cpu_weight.amount > 0)) {
                /* We are using inline actions, since deferred actions will be depracated */
-               eosiosystem::system_contract::undelegatebw_action unstaker("eosio"_n, {unstaking_iterator->account_name, "active"_n});
-               unstaker.send(unstaking_iterator->account_name, unstaking_iterator->account_name, staked_iterator->net_weight, staked_iterator->cpu_weight);
+               unstaker.set_actor(unstaking_iterator->account_name);
+               unstaker.set(0, unstaking_iterator->account_name);
+               unstaker.set(8, unstaking_iterator->account_name);
+               unstaker.set(16, staked->net_weight);
+               unstaker.set(32, staked->cpu_weight);
+               unstaker.send();
                DEBUG("Sent inline transaction eosio::undelegate()...");
+               stats.unstaked++;
+               unstaked_amount = staked->net_weight + staked->cpu_weight;
+
+               /* undelegatebw (re)starts the refund timer */
+               matures = now + config::refund_delay_sec;
             } else {
                DEBUG("Nothing to unstake? Skipping...");
+               matures = refund_maturity(unstaking_iterator->account_name);
             }
 
-            recover_accounts recovering(get_self(), get_self().value);
+            recover_accounts recovering(get_self(), campaign_name.value);
 
             recovering.emplace(get_self(), [&](auto& a) {
                a.account_name = unstaking_iterator->account_name;
+               a.matures = matures;
+               a.added = unstaking_iterator->added;
+               a.unstaked = now;
+               a.ram_usage = unstaking_iterator->ram_usage;
             });
+            record_latency(latency.add_to_unstake, unstaking_iterator->added, now);
 
-            unstaking_iterator = unstaking.erase(unstaking_iterator);
+            log_transition(campaign_name, unstaking_iterator->account_name, "unstake"_n, "recover"_n, unstaked_amount,
+                           unstaked_amount.amount > 0 ? transition_reason::unstaked : transition_reason::nothing_staked);
+
+            stats.unstake_rows--;
+            stats.recover_rows++;
+
+            unstaking_iterator = by_value.erase(unstaking_iterator);
          }
 
          check(i > 0, "No accounts to unstake");
+         statistics_table.set(stats, get_self());
+         latencies_table.set(latency, get_self());
       }
 
       [[eosio::action]]
-      void recover(uint8_t n) {
+      void recover(name campaign_name, uint8_t n) {
          int i;
 
+         require_open(campaign_name);
+
          DEBUG("Recovering tokens from the next account from the list...");
          /* REMEMBER: Remember to check that unstaking is done */
-         recover_accounts recovering(get_self(), get_self().value);
+         recover_accounts recovering(get_self(), campaign_name.value);
+         statistics_singleton statistics_table(get_self(), campaign_name.value);
+         auto stats = statistics_table.get_or_default();
+         latencies_singleton latencies_table(get_self(), campaign_name.value);
+         auto latency = latencies_table.get_or_default();
+         auto by_maturity = recovering.get_index<"bymaturity"_n>();
+         time_point_sec now(current_time_point());
+
+         /* refund(owner), sellram(account, bytes), bidrefund(bidder, newname),
+            sweep(campaign_name, account_name) and transfer(from, to, quantity, memo) */
+         inline_template refund(config::system_account, "refund"_n, name());
+         inline_template transfer(config::token_account, "transfer"_n, name(), get_self(), asset(0, config::core_symbol), std::string(config::memo));
+
+         /* Templates of disabled stages are never packed */
+         std::optional<inline_template> seller, claimer, sweeper;
+         if constexpr (config::ram_stage) {
+            seller.emplace(config::system_account, "sellram"_n, name(), int64_t(0));
+         }
+         if constexpr (config::bidrefund_stage) {
+            claimer.emplace(config::system_account, "bidrefund"_n, name(), name());
+         }
+         if constexpr (config::ram_stage || config::bidrefund_stage) {
+            sweeper.emplace(get_self(), "sweep"_n, campaign_name, name());
+            sweeper->set_actor(get_self());
+         }
 
-         auto recovering_iterator = recovering.begin();
+         auto recovering_iterator = by_maturity.begin();
 
-         /* The list is implicitly ordered for us, since both of the tables
-            have "name" as their primary key. That's why we don't need to care
-            that unstaking delay would disturb us? */
-         for(i = 0;  i < n && recovering_iterator != recovering.end(); i++) {
-            DEBUG("Recover TLOS from: ", recovering_iterator->account_name);
+         /* We walk the list in refund maturity order, so everything after the
+            first immature account is immature too and we can stop there instead
+            of rescanning accounts that are still waiting for the unstaking delay */
+         for(i = 0;  i < n && recovering_iterator != by_maturity.end() && recovering_iterator->matures <= now; i++) {
+            DEBUG("Recover tokens from: ", recovering_iterator->account_name);
 
             /* Unstaking must not be in progress */
-            eosiosystem::refunds_table refunding("eosio"_n, recovering_iterator->account_name.value);
-            auto refunding_iterator = refunding.find(recovering_iterator->account_name.value);
-            if(refunding_iterator != refunding.end()) {
-               /* We try to refund, if successful, we will skip the account for now. If not successful, we will bail out */
-               eosiosystem::system_contract::refund_action refund("eosio"_n, {recovering_iterator->account_name, "active"_n});
-               refund.send(recovering_iterator->account_name);
-               DEBUG("eosio::refund() had to be called, skipping this account for now...");
-               recovering_iterator++;
+            time_point_sec matures = refund_maturity(recovering_iterator->account_name);
+            if(matures != time_point_sec()) {
+               /* eosio::refund() asserts on immature refunds, and that would fail the whole batch
+                  because of a single account. Hence we only call it when it can succeed. */
+               if(matures <= now) {
+                  refund.set_actor(recovering_iterator->account_name);
+                  refund.set(0, recovering_iterator->account_name);
+                  refund.send();
+                  DEBUG("eosio::refund() had to be called, skipping this account for now...");
+                  stats.refunded++;
+                  log_transition(campaign_name, recovering_iterator->account_name, "recover"_n, "recover"_n, asset(0, config::core_symbol), transition_reason::refunded);
+                  recovering_iterator++;
+               } else {
+                  /* The account has unstaked again by itself, so we move it back in the queue */
+                  DEBUG("Refund not yet mature, skipping this account for now...");
+                  stats.immature++;
+                  log_transition(campaign_name, recovering_iterator->account_name, "recover"_n, "recover"_n, asset(0, config::core_symbol), transition_reason::refund_pending);
+                  auto modified_iterator = recovering_iterator++;
+                  by_maturity.modify(modified_iterator, same_payer, [&](auto& a) {
+                     a.matures = matures;
+                  });
+               }
                continue;
             }
 
-            asset balance = token::get_balance("eosio.token"_n, recovering_iterator->account_name, symbol_code("TLOS"));
+            /* Tokens from selling RAM and from bid refunds only reach the balance once
+               those inline actions have run, so in that case the transfer is left to sweep() */
+            if constexpr (config::ram_stage || config::bidrefund_stage) {
+               bool sweep_later = false;
 
-            if(balance.amount > 0) {
-               token::transfer_action transfer("eosio.token"_n, {recovering_iterator->account_name, "active"_n});
-               transfer.send(recovering_iterator->account_name, get_self(), balance, "Recovering tokens per TBNOA: https://chainspector.io/dashboard/ratify-proposals/0");
-            } else {
-               DEBUG("Nothing to recover, skipping...");
+               if constexpr (config::ram_stage) {
+                  int64_t ram_bytes = sellable_ram(recovering_iterator->account_name, recovering_iterator->ram_usage);
+
+                  if(ram_bytes > 0) {
+                     seller->set_actor(recovering_iterator->account_name);
+                     seller->set(0, recovering_iterator->account_name);
+                     seller->set(8, ram_bytes);
+                     seller->send();
+                     DEBUG("Sent inline transaction eosio::sellram()...");
+                     stats.ram_sold += ram_bytes;
+                     sweep_later = true;
+                  }
+               }
+
+               if constexpr (config::bidrefund_stage) {
+                  if(claim_bid_refunds(campaign_name, recovering_iterator->account_name, *claimer, stats)) {
+                     sweep_later = true;
+                  }
+               }
+
+               if(sweep_later) {
+                  /* Inline actions run in order, so sweep() sees all of the proceeds.
+                     The row stays until sweep() has transferred them and erases it. */
+                  DEBUG("Transferring after the inline actions...");
+                  sweeper->set(8, recovering_iterator->account_name);
+                  sweeper->send();
+                  recovering_iterator++;
+                  continue;
+               }
             }
 
-            recovering_iterator = recovering.erase(recovering_iterator);
+            sweep_internal(campaign_name, recovering_iterator->account_name, transfer, stats);
+            retire_recovery(*recovering_iterator, stats, latency, now);
+
+            recovering_iterator = by_maturity.erase(recovering_iterator);
          }
 
-         check(i > 0, "No accounts to recover");
+         check(i > 0, "No accounts ready to recover");
+         statistics_table.set(stats, get_self());
+         latencies_table.set(latency, get_self());
       }
 };